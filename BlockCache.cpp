@@ -0,0 +1,158 @@
+#include "BlockCache.h"
+#include <initializer_list>
+#include <sys/stat.h>
+
+namespace Reader {
+
+size_t BlockCache::KeyHash::operator()(const Key& key) const
+{
+    u64 hash = key.file.device * 0x9e3779b97f4a7c15ull;
+    for (u64 part : { key.file.inode, key.file.size, key.file.modified_seconds, key.file.modified_nanoseconds, key.offset })
+        hash ^= part + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+    return hash;
+}
+
+BlockCache::BlockCache(size_t memory_budget, size_t block_size, size_t shard_count)
+    : m_block_size(block_size > 0 ? block_size : 1)
+    , m_shard_count(shard_count > 0 ? shard_count : 1)
+    , m_shards(new Shard[m_shard_count])
+    , m_memory_budget(memory_budget)
+{
+}
+
+BlockCache& BlockCache::shared()
+{
+    static BlockCache cache(64 * 1024 * 1024);
+    return cache;
+}
+
+bool BlockCache::identify(FILE* file_handle, FileId& file)
+{
+    struct stat info { };
+    if (fstat(fileno(file_handle), &info) == -1)
+        return false;
+    file = { (u64)info.st_dev, (u64)info.st_ino, (u64)info.st_size, (u64)info.st_mtim.tv_sec, (u64)info.st_mtim.tv_nsec };
+    return true;
+}
+
+BlockCache::Shard& BlockCache::shard_for(const Key& key)
+{
+    return m_shards[KeyHash {}(key) % m_shard_count];
+}
+
+size_t BlockCache::blocks_per_shard() const
+{
+    size_t blocks = m_memory_budget / m_block_size / m_shard_count;
+    return blocks > 0 ? blocks : 1;
+}
+
+size_t BlockCache::cached_blocks_count()
+{
+    size_t count = 0;
+    for (size_t i = 0; i < m_shard_count; i++) {
+        std::lock_guard guard(m_shards[i].lock);
+        count += m_shards[i].ring.size();
+    }
+    return count;
+}
+
+// Advances the clock hand until it finds a block that is neither recently used nor
+// pinned by a reader. Two full turns are enough to clear every reference bit, so
+// giving up after that means every block is pinned.
+bool BlockCache::evict_one(Shard& shard)
+{
+    auto& ring = shard.ring;
+    for (size_t step = 0; step < 2 * ring.size(); step++) {
+        if (shard.hand >= ring.size())
+            shard.hand = 0;
+
+        Entry& entry = ring[shard.hand];
+        if (entry.referenced) {
+            entry.referenced = false;
+            shard.hand++;
+            continue;
+        }
+        if (entry.block.use_count() > 1) {
+            shard.hand++;
+            continue;
+        }
+
+        shard.index.erase(entry.key);
+        if (shard.hand != ring.size() - 1) {
+            entry = std::move(ring.back());
+            shard.index[entry.key] = shard.hand;
+        }
+        ring.pop_back();
+        m_evictions++;
+        return true;
+    }
+    return false;
+}
+
+void BlockCache::shrink(Shard& shard)
+{
+    size_t limit = blocks_per_shard();
+    while (shard.ring.size() > limit && evict_one(shard))
+        ;
+}
+
+void BlockCache::set_memory_budget(size_t memory_budget)
+{
+    m_memory_budget = memory_budget;
+    for (size_t i = 0; i < m_shard_count; i++) {
+        std::lock_guard guard(m_shards[i].lock);
+        shrink(m_shards[i]);
+    }
+}
+
+std::shared_ptr<const CachedBlock> BlockCache::acquire(FILE* file_handle, const FileId& file, u64 offset)
+{
+    Key key { file, offset };
+    Shard& shard = shard_for(key);
+
+    {
+        std::lock_guard guard(shard.lock);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            Entry& entry = shard.ring[it->second];
+            entry.referenced = true;
+            m_hits++;
+            return entry.block;
+        }
+    }
+
+    // Read outside of the lock so a slow disk doesn't stall readers of other blocks.
+    m_misses++;
+    auto block = std::make_shared<CachedBlock>();
+    block->data.reset(new u8[m_block_size]);
+    block->size = 0;
+    if (fseek(file_handle, (long)offset, SEEK_SET) == -1)
+        return block;
+    block->size = fread(block->data.get(), 1, m_block_size, file_handle);
+
+    // Only a block holding exactly what the identified file has at `offset` may be
+    // shared. A read error or a file that changed under us is served to this reader
+    // alone, so it can't truncate the file for everybody else.
+    size_t expected_size = offset < file.size ? file.size - offset : 0;
+    if (expected_size > m_block_size)
+        expected_size = m_block_size;
+    if (ferror(file_handle) || block->size == 0 || block->size != expected_size)
+        return block;
+
+    std::lock_guard guard(shard.lock);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+        // Somebody else loaded the same block in the meantime, share theirs.
+        Entry& entry = shard.ring[it->second];
+        entry.referenced = true;
+        return entry.block;
+    }
+
+    while (shard.ring.size() >= blocks_per_shard() && evict_one(shard))
+        ;
+    shard.index[key] = shard.ring.size();
+    shard.ring.push_back({ key, block, false });
+    return block;
+}
+
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include "Types.h"
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace Reader {
+
+struct CachedBlock {
+    std::unique_ptr<u8[]> data;
+    size_t size;
+};
+
+// Thread-safe cache of fixed-size file blocks, shared between readers so that hot
+// blocks are read from disk once per process rather than once per reader.
+// Blocks are keyed by (file, block offset) and evicted with a CLOCK sweep once the
+// memory budget is exceeded. Blocks pinned by a reader are never evicted.
+class BlockCache {
+public:
+    struct Stats {
+        u64 hits;
+        u64 misses;
+        u64 evictions;
+    };
+
+private:
+    struct Key {
+        FileId file;
+        u64 offset;
+
+        bool operator==(const Key&) const = default;
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+
+    struct Entry {
+        Key key;
+        std::shared_ptr<const CachedBlock> block;
+        bool referenced;
+    };
+
+    // Each shard runs its own CLOCK over a slice of the budget, so that readers
+    // hitting different blocks rarely contend on the same lock.
+    struct Shard {
+        std::mutex lock;
+        std::unordered_map<Key, size_t, KeyHash> index;
+        std::vector<Entry> ring;
+        size_t hand = 0;
+    };
+
+    const size_t m_block_size;
+    const size_t m_shard_count;
+    std::unique_ptr<Shard[]> m_shards;
+    std::atomic<size_t> m_memory_budget;
+
+    std::atomic<u64> m_hits = 0;
+    std::atomic<u64> m_misses = 0;
+    std::atomic<u64> m_evictions = 0;
+
+    Shard& shard_for(const Key&);
+    size_t blocks_per_shard() const;
+    bool evict_one(Shard&);
+    void shrink(Shard&);
+
+public:
+    explicit BlockCache(size_t memory_budget, size_t block_size = 4096, size_t shard_count = 8);
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
+
+    // Process-wide cache with a 64 MiB budget. Lives until the program exits.
+    static BlockCache& shared();
+
+    // Fills `file` with the identity of the open file. Returns false if it can't be
+    // determined, in which case the file must not be read through the cache.
+    static bool identify(FILE*, FileId& file);
+
+    [[nodiscard]] size_t block_size() const { return m_block_size; }
+    [[nodiscard]] size_t memory_budget() const { return m_memory_budget; }
+    [[nodiscard]] size_t cached_blocks_count();
+    [[nodiscard]] Stats stats() const { return { m_hits, m_misses, m_evictions }; }
+
+    // Evicts unpinned blocks until the cache fits in the new budget.
+    void set_memory_budget(size_t);
+
+    // Returns the block starting at `offset`, reading it through `file_handle` on a miss.
+    // The block stays pinned for as long as the returned pointer is alive. Empty blocks
+    // and blocks that failed to read in full are returned but never cached.
+    std::shared_ptr<const CachedBlock> acquire(FILE* file_handle, const FileId&, u64 offset);
+};
+
+}
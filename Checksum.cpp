@@ -0,0 +1,390 @@
+#include "Checksum.h"
+#include <array>
+#include <bit>
+#include <cstring>
+
+#if defined(__x86_64__)
+#    include <immintrin.h>
+#    define HAS_X86_CHECKSUMS 1
+#else
+#    define HAS_X86_CHECKSUMS 0
+#endif
+
+namespace Reader {
+
+using Tables = std::array<std::array<u32, 256>, 8>;
+
+// Slicing-by-8 tables for the reflected form of `polynomial`.
+constexpr Tables make_tables(u32 polynomial)
+{
+    Tables tables {};
+    for (u32 i = 0; i < 256; i++) {
+        u32 crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ ((crc & 1) ? polynomial : 0);
+        tables[0][i] = crc;
+    }
+    for (u32 i = 0; i < 256; i++) {
+        for (int slice = 1; slice < 8; slice++)
+            tables[slice][i] = (tables[slice - 1][i] >> 8) ^ tables[0][tables[slice - 1][i] & 0xFF];
+    }
+    return tables;
+}
+
+constexpr Tables crc32_tables = make_tables(0xEDB88320);
+constexpr Tables crc32c_tables = make_tables(0x82F63B78);
+
+static u32 crc_software(const Tables& tables, u32 crc, const u8* data, size_t size)
+{
+    while (size >= 8) {
+        u32 low, high;
+        memcpy(&low, data, 4);
+        memcpy(&high, data + 4, 4);
+        if constexpr (std::endian::native == std::endian::big) {
+            low = __builtin_bswap32(low);
+            high = __builtin_bswap32(high);
+        }
+        low ^= crc;
+        crc = tables[7][low & 0xFF] ^ tables[6][(low >> 8) & 0xFF] ^ tables[5][(low >> 16) & 0xFF] ^ tables[4][low >> 24]
+            ^ tables[3][high & 0xFF] ^ tables[2][(high >> 8) & 0xFF] ^ tables[1][(high >> 16) & 0xFF] ^ tables[0][high >> 24];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0)
+        crc = (crc >> 8) ^ tables[0][(crc ^ *data++) & 0xFF];
+    return crc;
+}
+
+#if HAS_X86_CHECKSUMS
+__attribute__((target("sse4.2"))) static u32 crc32c_hardware(u32 crc, const u8* data, size_t size)
+{
+    u64 crc64 = crc;
+    while (size >= 8) {
+        u64 chunk;
+        memcpy(&chunk, data, 8);
+        crc64 = _mm_crc32_u64(crc64, chunk);
+        data += 8;
+        size -= 8;
+    }
+    crc = (u32)crc64;
+    while (size-- > 0)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+
+__attribute__((target("pclmul,sse4.1"))) static inline __m128i load(const u8* at)
+{
+    return _mm_loadu_si128((const __m128i*)at);
+}
+
+// Multiplies both halves of `x` by the matching folding constant in `k` and adds in `next`.
+__attribute__((target("pclmul,sse4.1"))) static inline __m128i fold(__m128i x, __m128i k, __m128i next)
+{
+    __m128i low = _mm_clmulepi64_si128(x, k, 0x00);
+    __m128i high = _mm_clmulepi64_si128(x, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(high, low), next);
+}
+
+// Folds 64 bytes per iteration with carry-less multiplication, then Barrett-reduces to
+// 32 bits ("Fast CRC Computation for Generic Polynomials Using PCLMULQDQ", Intel).
+// Anything below 64 bytes and the tail that doesn't fill a 16-byte lane goes through
+// the tables.
+__attribute__((target("pclmul,sse4.1"))) static u32 crc32_hardware(u32 crc, const u8* data, size_t size)
+{
+    if (size < 64)
+        return crc_software(crc32_tables, crc, data, size);
+
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_xor_si128(load(data), _mm_cvtsi32_si128((int)crc));
+    __m128i x2 = load(data + 16);
+    __m128i x3 = load(data + 32);
+    __m128i x4 = load(data + 48);
+    data += 64;
+    size -= 64;
+
+    while (size >= 64) {
+        x1 = fold(x1, k1k2, load(data));
+        x2 = fold(x2, k1k2, load(data + 16));
+        x3 = fold(x3, k1k2, load(data + 32));
+        x4 = fold(x4, k1k2, load(data + 48));
+        data += 64;
+        size -= 64;
+    }
+
+    x1 = fold(x1, k3k4, x2);
+    x1 = fold(x1, k3k4, x3);
+    x1 = fold(x1, k3k4, x4);
+
+    while (size >= 16) {
+        x1 = fold(x1, k3k4, load(data));
+        data += 16;
+        size -= 16;
+    }
+
+    // 128 -> 64 bits.
+    __m128i scratch = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), scratch);
+    scratch = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), k5, 0x00);
+    x1 = _mm_xor_si128(x1, scratch);
+
+    // 64 -> 32 bits.
+    scratch = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), poly, 0x10);
+    scratch = _mm_clmulepi64_si128(_mm_and_si128(scratch, low32), poly, 0x00);
+    x1 = _mm_xor_si128(x1, scratch);
+    crc = (u32)_mm_extract_epi32(x1, 1);
+
+    return crc_software(crc32_tables, crc, data, size);
+}
+#endif
+
+using UpdateFunction = u32 (*)(u32, const u8*, size_t);
+
+static u32 crc32_software(u32 crc, const u8* data, size_t size)
+{
+    return crc_software(crc32_tables, crc, data, size);
+}
+
+static u32 crc32c_software(u32 crc, const u8* data, size_t size)
+{
+    return crc_software(crc32c_tables, crc, data, size);
+}
+
+// Resolved on first use, which keeps them valid for callers running during static
+// initialisation of other translation units.
+static UpdateFunction crc32_update()
+{
+    static const UpdateFunction function = [] {
+#if HAS_X86_CHECKSUMS
+        if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+            return &crc32_hardware;
+#endif
+        return &crc32_software;
+    }();
+    return function;
+}
+
+static UpdateFunction crc32c_update()
+{
+    static const UpdateFunction function = [] {
+#if HAS_X86_CHECKSUMS
+        if (__builtin_cpu_supports("sse4.2"))
+            return &crc32c_hardware;
+#endif
+        return &crc32c_software;
+    }();
+    return function;
+}
+
+constexpr u64 xxh_prime1 = 0x9E3779B185EBCA87ull;
+constexpr u64 xxh_prime2 = 0xC2B2AE3D27D4EB4Full;
+constexpr u64 xxh_prime3 = 0x165667B19E3779F9ull;
+constexpr u64 xxh_prime4 = 0x85EBCA77C2B2AE63ull;
+constexpr u64 xxh_prime5 = 0x27D4EB2F165667C5ull;
+
+inline u64 read_le64(const u8* bytes)
+{
+    u64 value;
+    memcpy(&value, bytes, sizeof(value));
+    if constexpr (std::endian::native == std::endian::big)
+        value = __builtin_bswap64(value);
+    return value;
+}
+
+inline u32 read_le32(const u8* bytes)
+{
+    u32 value;
+    memcpy(&value, bytes, sizeof(value));
+    if constexpr (std::endian::native == std::endian::big)
+        value = __builtin_bswap32(value);
+    return value;
+}
+
+inline u64 xxh64_round(u64 lane, u64 input)
+{
+    lane += input * xxh_prime2;
+    lane = std::rotl(lane, 31);
+    return lane * xxh_prime1;
+}
+
+inline u64 xxh64_merge_round(u64 hash, u64 lane)
+{
+    hash ^= xxh64_round(0, lane);
+    return hash * xxh_prime1 + xxh_prime4;
+}
+
+constexpr u32 xxh32_prime1 = 0x9E3779B1u;
+constexpr u32 xxh32_prime2 = 0x85EBCA77u;
+constexpr u32 xxh32_prime3 = 0xC2B2AE3Du;
+constexpr u32 xxh32_prime4 = 0x27D4EB2Fu;
+constexpr u32 xxh32_prime5 = 0x165667B1u;
+
+inline u32 xxh32_round(u32 lane, u32 input)
+{
+    lane += input * xxh32_prime2;
+    lane = std::rotl(lane, 13);
+    return lane * xxh32_prime1;
+}
+
+void Checksum::reset(ChecksumKind kind)
+{
+    m_kind = kind;
+    m_crc = ~0u;
+    m_lanes[0] = xxh_prime1 + xxh_prime2;
+    m_lanes[1] = xxh_prime2;
+    m_lanes[2] = 0;
+    m_lanes[3] = -xxh_prime1;
+    m_lanes32[0] = xxh32_prime1 + xxh32_prime2;
+    m_lanes32[1] = xxh32_prime2;
+    m_lanes32[2] = 0;
+    m_lanes32[3] = -xxh32_prime1;
+    m_pending_count = 0;
+    m_total_size = 0;
+}
+
+// XXH32 and XXH64 only differ in the width of their lanes: four 32-bit lanes over
+// 16-byte stripes, or four 64-bit lanes over 32-byte stripes.
+template<ChecksumKind kind>
+void Checksum::consume_stripe(const u8* stripe)
+{
+    if constexpr (kind == ChecksumKind::Xxh64) {
+        for (int lane = 0; lane < 4; lane++)
+            m_lanes[lane] = xxh64_round(m_lanes[lane], read_le64(stripe + lane * 8));
+    } else {
+        for (int lane = 0; lane < 4; lane++)
+            m_lanes32[lane] = xxh32_round(m_lanes32[lane], read_le32(stripe + lane * 4));
+    }
+}
+
+template<ChecksumKind kind>
+void Checksum::update_xxhash(const u8* data, size_t size)
+{
+    constexpr size_t stripe_size = kind == ChecksumKind::Xxh64 ? 32 : 16;
+    m_total_size += size;
+
+    if (m_pending_count > 0) {
+        size_t taken = stripe_size - m_pending_count;
+        if (taken > size)
+            taken = size;
+        memcpy(m_pending + m_pending_count, data, taken);
+        m_pending_count += taken;
+        data += taken;
+        size -= taken;
+        if (m_pending_count < stripe_size)
+            return;
+        consume_stripe<kind>(m_pending);
+        m_pending_count = 0;
+    }
+
+    while (size >= stripe_size) {
+        consume_stripe<kind>(data);
+        data += stripe_size;
+        size -= stripe_size;
+    }
+
+    memcpy(m_pending, data, size);
+    m_pending_count = size;
+}
+
+u32 Checksum::xxh32_value() const
+{
+    u32 hash;
+    if (m_total_size >= 16)
+        hash = std::rotl(m_lanes32[0], 1) + std::rotl(m_lanes32[1], 7) + std::rotl(m_lanes32[2], 12) + std::rotl(m_lanes32[3], 18);
+    else
+        hash = xxh32_prime5;
+    hash += (u32)m_total_size;
+
+    const u8* tail = m_pending;
+    size_t size = m_pending_count;
+    for (; size >= 4; tail += 4, size -= 4) {
+        hash += read_le32(tail) * xxh32_prime3;
+        hash = std::rotl(hash, 17) * xxh32_prime4;
+    }
+    for (; size > 0; tail++, size--) {
+        hash += *tail * xxh32_prime5;
+        hash = std::rotl(hash, 11) * xxh32_prime1;
+    }
+
+    hash ^= hash >> 15;
+    hash *= xxh32_prime2;
+    hash ^= hash >> 13;
+    hash *= xxh32_prime3;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+u64 Checksum::xxh64_value() const
+{
+    u64 hash;
+    if (m_total_size >= 32) {
+        hash = std::rotl(m_lanes[0], 1) + std::rotl(m_lanes[1], 7) + std::rotl(m_lanes[2], 12) + std::rotl(m_lanes[3], 18);
+        for (u64 lane : m_lanes)
+            hash = xxh64_merge_round(hash, lane);
+    } else
+        hash = xxh_prime5;
+    hash += m_total_size;
+
+    const u8* tail = m_pending;
+    size_t size = m_pending_count;
+    for (; size >= 8; tail += 8, size -= 8) {
+        hash ^= xxh64_round(0, read_le64(tail));
+        hash = std::rotl(hash, 27) * xxh_prime1 + xxh_prime4;
+    }
+    if (size >= 4) {
+        hash ^= (u64)read_le32(tail) * xxh_prime1;
+        hash = std::rotl(hash, 23) * xxh_prime2 + xxh_prime3;
+        tail += 4;
+        size -= 4;
+    }
+    for (; size > 0; tail++, size--) {
+        hash ^= *tail * xxh_prime5;
+        hash = std::rotl(hash, 11) * xxh_prime1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= xxh_prime2;
+    hash ^= hash >> 29;
+    hash *= xxh_prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+void Checksum::update(const u8* data, size_t size)
+{
+    if (size == 0)
+        return;
+    switch (m_kind) {
+    case ChecksumKind::Crc32:
+        m_crc = crc32_update()(m_crc, data, size);
+        break;
+    case ChecksumKind::Crc32c:
+        m_crc = crc32c_update()(m_crc, data, size);
+        break;
+    case ChecksumKind::Xxh32:
+        update_xxhash<ChecksumKind::Xxh32>(data, size);
+        break;
+    case ChecksumKind::Xxh64:
+        update_xxhash<ChecksumKind::Xxh64>(data, size);
+        break;
+    }
+}
+
+u64 Checksum::value() const
+{
+    switch (m_kind) {
+    case ChecksumKind::Xxh32:
+        return xxh32_value();
+    case ChecksumKind::Xxh64:
+        return xxh64_value();
+    default:
+        return ~m_crc;
+    }
+}
+
+}
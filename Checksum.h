@@ -0,0 +1,48 @@
+#pragma once
+#include "Types.h"
+#include <cstddef>
+
+namespace Reader {
+
+enum class ChecksumKind {
+    Crc32,  // IEEE 802.3 polynomial, as used by zlib, gzip and PNG.
+    Crc32c, // Castagnoli polynomial, as used by iSCSI, ext4 and Snappy.
+    Xxh32,  // XXH32 with a zero seed, as used by LZ4 frames and blocks.
+    Xxh64,  // XXH64 with a zero seed, as used by zstd frames.
+};
+
+// Running checksum over a sequence of byte ranges. Uses SSE4.2 `crc32` for CRC32C and
+// PCLMUL folding for CRC32 when the CPU supports them, a table-driven fallback otherwise.
+class Checksum {
+    ChecksumKind m_kind;
+    u32 m_crc;
+
+    // xxHash consumes whole stripes into four lanes (`m_lanes32` for XXH32, `m_lanes`
+    // for XXH64). Bytes of an unfinished stripe wait in `m_pending` for the next update.
+    u64 m_lanes[4];
+    u32 m_lanes32[4];
+    u8 m_pending[32];
+    size_t m_pending_count;
+    u64 m_total_size;
+
+    template<ChecksumKind kind>
+    void consume_stripe(const u8*);
+
+    template<ChecksumKind kind>
+    void update_xxhash(const u8*, size_t);
+
+    [[nodiscard]] u32 xxh32_value() const;
+    [[nodiscard]] u64 xxh64_value() const;
+
+public:
+    explicit Checksum(ChecksumKind kind = ChecksumKind::Crc32c) { reset(kind); }
+
+    void reset(ChecksumKind);
+    void update(const u8*, size_t);
+
+    // CRCs and XXH32 occupy the low 32 bits.
+    [[nodiscard]] u64 value() const;
+    [[nodiscard]] ChecksumKind kind() const { return m_kind; }
+};
+
+}
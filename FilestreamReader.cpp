@@ -1,4 +1,7 @@
 #include "FilestreamReader.h"
+#include "BlockCache.h"
+#include <bit>
+#include <cstring>
 
 #define DEBUG 0
 
@@ -32,6 +35,24 @@ inline u8 min(u8 a, u8 b)
     return (a < b) ? a : b;
 }
 
+inline u64 load_le64(const u8* bytes)
+{
+    u64 value;
+    memcpy(&value, bytes, sizeof(value));
+    if constexpr (std::endian::native == std::endian::big)
+        value = __builtin_bswap64(value);
+    return value;
+}
+
+inline u64 load_be64(const u8* bytes)
+{
+    u64 value;
+    memcpy(&value, bytes, sizeof(value));
+    if constexpr (std::endian::native == std::endian::little)
+        value = __builtin_bswap64(value);
+    return value;
+}
+
 bool FilestreamReader::ensure_valid_initialization()
 {
     if (m_file_handle == nullptr) {
@@ -43,24 +64,60 @@ bool FilestreamReader::ensure_valid_initialization()
     return true;
 }
 
-FilestreamReader::FilestreamReader(const std::string& file_name, const ByteOrder order, const size_t internal_buffer_capacity)
+FilestreamReader::FilestreamReader(const std::string& file_name, const BitOrder bit_order, const ByteOrder order, const size_t internal_buffer_capacity, BlockCache* cache)
     : m_default_order(order)
+    , m_bit_order(bit_order)
     , m_buffer_capacity(internal_buffer_capacity)
-    , m_buffer(new u8[m_buffer_capacity])
+    , m_storage(cache ? nullptr : new u8[m_buffer_capacity])
+    , m_buffer(m_storage)
     , m_file_handle(fopen(file_name.c_str(), "r"))
+    , m_cache(cache)
 {
+    if (m_cache)
+        attach_cache_or_fall_back();
     if (!ensure_valid_initialization())
         set_error(true);
 }
 
+FilestreamReader::FilestreamReader(const std::string& file_name, const ByteOrder order, const size_t internal_buffer_capacity)
+    : FilestreamReader(file_name, BitOrder::MsbFirst, order, internal_buffer_capacity, nullptr)
+{
+}
+
 FilestreamReader::FilestreamReader(const std::string& file_name, const size_t internal_buffer_capacity)
-    : m_default_order(ByteOrder::BigEndian)
-    , m_buffer_capacity(internal_buffer_capacity)
-    , m_buffer(new u8[m_buffer_capacity])
-    , m_file_handle(fopen(file_name.c_str(), "r"))
+    : FilestreamReader(file_name, BitOrder::MsbFirst, ByteOrder::BigEndian, internal_buffer_capacity, nullptr)
+{
+}
+
+FilestreamReader::FilestreamReader(const std::string& file_name, const BitOrder bit_order, const ByteOrder order, const size_t internal_buffer_capacity)
+    : FilestreamReader(file_name, bit_order, order, internal_buffer_capacity, nullptr)
+{
+}
+
+FilestreamReader::FilestreamReader(const std::string& file_name, const BitOrder bit_order, const size_t internal_buffer_capacity)
+    : FilestreamReader(file_name, bit_order, natural_byte_order(bit_order), internal_buffer_capacity, nullptr)
 {
-    if (!ensure_valid_initialization())
-        set_error(true);
+}
+
+FilestreamReader::FilestreamReader(const std::string& file_name, BlockCache& cache, const BitOrder bit_order, const ByteOrder order)
+    : FilestreamReader(file_name, bit_order, order, cache.block_size(), &cache)
+{
+}
+
+FilestreamReader::FilestreamReader(const std::string& file_name, BlockCache& cache, const BitOrder bit_order)
+    : FilestreamReader(file_name, bit_order, natural_byte_order(bit_order), cache.block_size(), &cache)
+{
+}
+
+void FilestreamReader::attach_cache_or_fall_back()
+{
+    if (m_file_handle == nullptr || BlockCache::identify(m_file_handle, m_file_id))
+        return;
+    // Without a reliable identity our blocks could be mixed up with another file's.
+    dbg_error("Couldn't identify file, reading without the cache!\n");
+    m_cache = nullptr;
+    m_storage = new u8[m_buffer_capacity];
+    m_buffer = m_storage;
 }
 
 FilestreamReader::~FilestreamReader()
@@ -68,19 +125,37 @@ FilestreamReader::~FilestreamReader()
     if (m_file_handle != nullptr) {
         fclose(m_file_handle);
         m_file_handle = nullptr;
-        delete[] m_buffer;
     }
+    delete[] m_storage;
 }
 
 void FilestreamReader::reload_buffer()
 {
-    // Fixme: We are ignoring any possibility of errors.
-    m_loaded_bytes_count = fread(m_buffer, 1, m_buffer_capacity, m_file_handle);
+    // Everything left in the buffer has been consumed by now.
+    if (m_checksum_active && m_checksum_from < m_loaded_bytes_count)
+        m_checksum.update(m_buffer + m_checksum_from, m_loaded_bytes_count - m_checksum_from);
+
+    if (m_cache) {
+        // A short block already told us where the file ends, don't ask the cache past it.
+        if (m_eof) {
+            m_loaded_bytes_count = 0;
+        } else {
+            // Pinning the next block also releases the previous one back to the cache.
+            m_block = m_cache->acquire(m_file_handle, m_file_id, m_file_cursor);
+            m_buffer = m_block->data.get();
+            m_loaded_bytes_count = m_block->size;
+        }
+    } else {
+        // Fixme: We are ignoring any possibility of errors.
+        m_loaded_bytes_count = fread(m_storage, 1, m_buffer_capacity, m_file_handle);
+    }
+    m_file_cursor += m_loaded_bytes_count;
     set_eof(m_loaded_bytes_count < m_buffer_capacity);
     if (m_loaded_bytes_count > 0) {
         m_bit_cursor = 0;
         m_byte_cursor = 0;
     }
+    m_checksum_from = m_loaded_bytes_count > 0 ? 0 : m_byte_cursor;
 }
 
 bool FilestreamReader::reload_byte_if_necessary()
@@ -100,15 +175,61 @@ bool FilestreamReader::reload_byte_if_necessary()
     return true;
 }
 
-u64 FilestreamReader::read_bits(u8 amount, const ByteOrder order)
+// Fast path for the natural pairings (MSB-first + big endian, LSB-first + little endian),
+// where the requested bits form one contiguous run of the stream. Pulls them out of a
+// 64-bit window over the buffer instead of walking byte by byte. Returns false (without
+// touching the state) when the window doesn't fit in the loaded part of the buffer.
+template<BitOrder bit_order, ByteOrder order>
+bool FilestreamReader::read_window(u8 amount, u64& result)
 {
-    if (amount > 64) {
-        set_error(true);
-        dbg_error("Cannot read more than 64 bits at once!\n");
-        return 0;
+    if (amount == 0 || m_byte_cursor == 0)
+        return false;
+
+    size_t bit_position = (m_byte_cursor - 1) * 8 + m_bit_cursor;
+    size_t start = bit_position / 8;
+    u8 offset = bit_position % 8;
+    bool spills = offset + amount > 64;
+    if (start + 8 + spills > m_loaded_bytes_count)
+        return false;
+
+    if constexpr (bit_order == BitOrder::LsbFirst) {
+        result = load_le64(m_buffer + start) >> offset;
+        if (spills)
+            result |= (u64)m_buffer[start + 8] << (64 - offset);
+        if (amount < 64)
+            result &= (u64(1) << amount) - 1;
+    } else {
+        u64 window = load_be64(m_buffer + start);
+        if (spills) {
+            u8 extra = offset + amount - 64;
+            result = ((window & (~u64(0) >> offset)) << extra) | (m_buffer[start + 8] >> (8 - extra));
+        } else
+            result = (window << offset) >> (64 - amount);
+    }
+
+    // Leave the cursors exactly where the byte-wise path would have.
+    size_t end = bit_position + amount;
+    if (end % 8 == 0) {
+        m_byte_cursor = end / 8;
+        m_bit_cursor = 8;
+    } else {
+        m_byte_cursor = end / 8 + 1;
+        m_bit_cursor = end % 8;
     }
+    m_current_byte = m_buffer[m_byte_cursor - 1];
+    return true;
+}
 
+template<BitOrder bit_order, ByteOrder order>
+u64 FilestreamReader::read_bits_impl(u8 amount)
+{
     u64 accumulator = 0;
+    constexpr bool contiguous = (bit_order == BitOrder::MsbFirst) == (order == ByteOrder::BigEndian);
+    if constexpr (contiguous) {
+        if (read_window<bit_order, order>(amount, accumulator))
+            return accumulator;
+    }
+
     u8 accumulation_count = 0;
 
     while (amount > 0) {
@@ -117,10 +238,15 @@ u64 FilestreamReader::read_bits(u8 amount, const ByteOrder order)
             return accumulator;
         }
         u8 read_count = min(amount, 8 - m_bit_cursor);
-        u8 shift_width = 8 - (m_bit_cursor + read_count);
-        u64 extracted_bits = (m_current_byte & (bitmask[read_count] << shift_width)) >> shift_width;
+        u64 extracted_bits;
+        if constexpr (bit_order == BitOrder::LsbFirst)
+            extracted_bits = (m_current_byte >> m_bit_cursor) & bitmask[read_count];
+        else {
+            u8 shift_width = 8 - (m_bit_cursor + read_count);
+            extracted_bits = (m_current_byte & (bitmask[read_count] << shift_width)) >> shift_width;
+        }
 
-        if (order == ByteOrder::LittleEndian) {
+        if constexpr (order == ByteOrder::LittleEndian) {
             accumulator |= (extracted_bits << accumulation_count);
             accumulation_count += read_count;
         } else
@@ -135,6 +261,25 @@ u64 FilestreamReader::read_bits(u8 amount, const ByteOrder order)
     return accumulator;
 }
 
+u64 FilestreamReader::read_bits(u8 amount, const ByteOrder order)
+{
+    if (amount > 64) {
+        set_error(true);
+        dbg_error("Cannot read more than 64 bits at once!\n");
+        return 0;
+    }
+
+    if (m_bit_order == BitOrder::LsbFirst) {
+        if (order == ByteOrder::LittleEndian)
+            return read_bits_impl<BitOrder::LsbFirst, ByteOrder::LittleEndian>(amount);
+        return read_bits_impl<BitOrder::LsbFirst, ByteOrder::BigEndian>(amount);
+    }
+
+    if (order == ByteOrder::LittleEndian)
+        return read_bits_impl<BitOrder::MsbFirst, ByteOrder::LittleEndian>(amount);
+    return read_bits_impl<BitOrder::MsbFirst, ByteOrder::BigEndian>(amount);
+}
+
 size_t FilestreamReader::remaining_bits_in_buffer() const
 {
     size_t remaining_full_bytes_in_buffer = m_loaded_bytes_count - m_byte_cursor;
@@ -144,12 +289,15 @@ size_t FilestreamReader::remaining_bits_in_buffer() const
 
 void FilestreamReader::wrap_state(u8 amount)
 {
-    m_state.file_cursor = ftell(m_file_handle);
+    m_state.file_cursor = m_file_cursor;
     m_state.byte_cursor = m_byte_cursor;
     m_state.bit_cursor = m_bit_cursor;
     m_state.current_byte = m_current_byte;
     m_state.loaded_bytes_count = m_loaded_bytes_count;
     m_state.eof = m_eof;
+    m_state.checksum = m_checksum;
+    m_state.checksum_from = m_checksum_from;
+    m_state.block = m_block;
 
     size_t remaining = remaining_bits_in_buffer();
     m_state.will_reload_buffer = (amount > remaining);
@@ -157,18 +305,60 @@ void FilestreamReader::wrap_state(u8 amount)
 
 void FilestreamReader::unwrap_state()
 {
-    size_t seek_position = m_state.file_cursor - m_state.loaded_bytes_count;
-    bool failed = fseek(m_file_handle, seek_position, SEEK_SET) == -1;
-    if (failed) {
-        set_error(true);
-        return;
+    if (m_cache) {
+        // The block we started from stayed pinned in the saved state, so go back to it
+        // without asking the cache again.
+        m_block = std::move(m_state.block);
+        m_buffer = m_block->data.get();
+        m_file_cursor = m_state.file_cursor;
+    } else {
+        size_t seek_position = m_state.file_cursor - m_state.loaded_bytes_count;
+        bool failed = fseek(m_file_handle, seek_position, SEEK_SET) == -1;
+        if (failed) {
+            set_error(true);
+            return;
+        }
+        m_file_cursor = seek_position;
+        // The checksum is restored from the saved state below, don't hash the buffer we
+        // are leaving on the way.
+        m_checksum_from = m_loaded_bytes_count;
+        reload_buffer();
     }
-    reload_buffer();
     m_byte_cursor = m_state.byte_cursor;
     m_bit_cursor = m_state.bit_cursor;
     m_current_byte = m_state.current_byte;
     m_loaded_bytes_count = m_state.loaded_bytes_count;
     m_eof = m_state.eof;
+    m_checksum = m_state.checksum;
+    m_checksum_from = m_state.checksum_from;
+}
+
+size_t FilestreamReader::consumed_bits_in_buffer() const
+{
+    if (m_byte_cursor == 0)
+        return 0;
+    return (m_byte_cursor - 1) * 8 + m_bit_cursor;
+}
+
+void FilestreamReader::begin_checksum(ChecksumKind kind)
+{
+    m_checksum.reset(kind);
+    m_checksum_from = consumed_bits_in_buffer() / 8;
+    m_checksum_active = true;
+}
+
+u64 FilestreamReader::end_checksum()
+{
+    if (!m_checksum_active)
+        return m_checksum.value();
+
+    size_t until = (consumed_bits_in_buffer() + 7) / 8;
+    if (until > m_loaded_bytes_count)
+        until = m_loaded_bytes_count;
+    if (m_checksum_from < until)
+        m_checksum.update(m_buffer + m_checksum_from, until - m_checksum_from);
+    m_checksum_active = false;
+    return m_checksum.value();
 }
 
 u64 FilestreamReader::peak_bits(u8 amount, const ByteOrder order)
@@ -1,20 +1,37 @@
 #pragma once
-#include <cinttypes>
+#include "Checksum.h"
+#include "Types.h"
+#include <cstdio>
+#include <memory>
 #include <string>
 #include <vector>
 
 namespace Reader {
 
-using u8 = uint8_t;
-using u16 = uint16_t;
-using u32 = uint32_t;
-using u64 = uint64_t;
+class BlockCache;
+struct CachedBlock;
 
 enum class ByteOrder {
     BigEndian,
     LittleEndian
 };
 
+// Order in which bits are consumed from within a single byte. `MsbFirst` suits most
+// media formats, `LsbFirst` suits DEFLATE, Brotli and friends. `ByteOrder` still
+// decides how the consumed bit groups are assembled into the result.
+// `MsbFirst` pairs with `BigEndian` and `LsbFirst` with `LittleEndian`: those read the
+// stream as one contiguous run of bits and take the fast path. The other two pairings
+// assemble multi-byte values group by group.
+enum class BitOrder {
+    MsbFirst,
+    LsbFirst
+};
+
+constexpr ByteOrder natural_byte_order(BitOrder bit_order)
+{
+    return bit_order == BitOrder::LsbFirst ? ByteOrder::LittleEndian : ByteOrder::BigEndian;
+}
+
 class FilestreamReader {
 
     struct State {
@@ -25,14 +42,33 @@ class FilestreamReader {
         size_t loaded_bytes_count;
         bool eof;
         bool will_reload_buffer;
+        Checksum checksum;
+        size_t checksum_from;
+        std::shared_ptr<const CachedBlock> block;
     } m_state;
 
     FilestreamReader() = delete;
+    FilestreamReader(const std::string& file_name, BitOrder, ByteOrder, size_t internal_buffer_capacity, BlockCache*);
 
     const ByteOrder m_default_order;
+    const BitOrder m_bit_order;
     size_t m_buffer_capacity;
-    u8* m_buffer;
+    u8* m_storage;
+    const u8* m_buffer;
     FILE* m_file_handle;
+    size_t m_file_cursor = 0;
+
+    // Set when attached to a block cache. `m_buffer` then points into the pinned block
+    // instead of `m_storage`.
+    BlockCache* m_cache = nullptr;
+    FileId m_file_id {};
+    std::shared_ptr<const CachedBlock> m_block;
+
+    // Bytes of the buffer from `m_checksum_from` onwards are folded into the running
+    // checksum when the buffer is about to be reloaded, or when the region ends.
+    bool m_checksum_active = false;
+    Checksum m_checksum;
+    size_t m_checksum_from = 0;
 
     u8 m_current_byte;
     size_t m_loaded_bytes_count = 0;
@@ -56,14 +92,32 @@ class FilestreamReader {
     }
 
     bool ensure_valid_initialization();
+    void attach_cache_or_fall_back();
     void reload_buffer();
     bool reload_byte_if_necessary();
     void wrap_state(u8 amount);
     void unwrap_state();
+    [[nodiscard]] size_t consumed_bits_in_buffer() const;
+
+    template<BitOrder bit_order, ByteOrder order>
+    u64 read_bits_impl(u8);
+
+    template<BitOrder bit_order, ByteOrder order>
+    bool read_window(u8, u64&);
 
 public:
     explicit FilestreamReader(const std::string& file_name, ByteOrder order = ByteOrder::BigEndian, const size_t internal_buffer_capacity = 4096);
     explicit FilestreamReader(const std::string& file_name, const size_t internal_buffer_capacity);
+    explicit FilestreamReader(const std::string& file_name, BitOrder bit_order, ByteOrder order, const size_t internal_buffer_capacity = 4096);
+
+    // Uses the natural byte order of `bit_order`, see `BitOrder`.
+    explicit FilestreamReader(const std::string& file_name, BitOrder bit_order, const size_t internal_buffer_capacity = 4096);
+
+    // Refills from `cache` (which must outlive the reader) instead of a private buffer.
+    // The buffer capacity is the block size of the cache. Falls back to a private
+    // buffer if the file can't be identified.
+    explicit FilestreamReader(const std::string& file_name, BlockCache& cache, BitOrder bit_order, ByteOrder order);
+    explicit FilestreamReader(const std::string& file_name, BlockCache& cache, BitOrder bit_order = BitOrder::MsbFirst);
     ~FilestreamReader();
 
     explicit operator bool() const
@@ -89,9 +143,13 @@ public:
     inline bool end_of_byte() { return m_bit_cursor > 7; }
     inline bool end_of_stream() { return end_of_byte() && end_of_buffer() && end_of_file(); }
     [[nodiscard]] size_t remaining_bits_in_buffer() const;
+    [[nodiscard]] BitOrder bit_order() const { return m_bit_order; }
 
-    // Reads `n` bits. Advances the bit cursor.
-    u64 read_bits(u8, const ByteOrder order = ByteOrder::BigEndian);
+    // Reads `n` bits in the bit order of the stream. Advances the bit cursor.
+    // Without an explicit order, bits are assembled in the natural order of the bit
+    // order (big endian for `MsbFirst`), regardless of the reader's default order.
+    u64 read_bits(u8, const ByteOrder order);
+    u64 read_bits(u8 amount) { return read_bits(amount, natural_byte_order(m_bit_order)); }
 
     // Reads 8 bits. Advances bit (if not aligned) and byte cursor.
     u8 read_byte(const ByteOrder order) { return (u8)read_bits(8, order); }
@@ -112,7 +170,8 @@ public:
     u64 read_qword(const ByteOrder order) { return (u64)read_bits(64, order); }
     u64 read_qword() { return read_qword(m_default_order); }
 
-    u64 peak_bits(u8, const ByteOrder order = ByteOrder::BigEndian);
+    u64 peak_bits(u8, const ByteOrder order);
+    u64 peak_bits(u8 amount) { return peak_bits(amount, natural_byte_order(m_bit_order)); }
 
     // Reads 8 bits without mutating the state of the stream.
     u8 peak_byte(const ByteOrder order) { return (u8)peak_bits(8, order); }
@@ -132,6 +191,13 @@ public:
 
     // Only modifies the bit cursor. New byte is not loaded until the next `read_*` call.
     void byte_align_forward() { m_bit_cursor = 8; }
+
+    // Starts checksumming the bytes consumed from here on. A partially consumed
+    // byte at either end of the region counts as a whole.
+    void begin_checksum(ChecksumKind kind = ChecksumKind::Crc32c);
+
+    // Returns the checksum of the bytes consumed since `begin_checksum()`.
+    u64 end_checksum();
 };
 
 }
@@ -1,4 +1,6 @@
 #include "FilestreamReader.h"
+#include "BlockCache.h"
+#include <cstdio>
 #include <iostream>
 
 namespace Reader {
@@ -6,6 +8,7 @@ namespace Reader {
 class TestFilestreamReader {
     static constexpr const char* s_path_8b_dat = "../test-files/8b.dat";
     static constexpr const char* s_path_9b_dat = "../test-files/9b.dat";
+    static constexpr const char* s_path_200b_dat = "../test-files/200b.dat";
 
     std::string m_current;
 
@@ -258,6 +261,309 @@ public:
         report_passed();
     }
 
+    void test_reading_aligned_lsb_first_bytes()
+    {
+        static constexpr u8 bytes[] = { 0xff, 0x10, 0xab, 0x30, 0x63, 0x58, 0xd7, 0x45 };
+        register_new("reading_aligned_lsb_first_bytes");
+        FilestreamReader reader(s_path_8b_dat, BitOrder::LsbFirst);
+        for (auto byte : bytes)
+            expect(byte == reader.read_byte());
+        report_passed();
+    }
+
+    void test_reading_unaligned_lsb_first_little_endian_bytes()
+    {
+        register_new("reading_unaligned_lsb_first_little_endian_bytes");
+        FilestreamReader reader(s_path_8b_dat, BitOrder::LsbFirst, ByteOrder::LittleEndian);
+        expect(reader.read_bits(3) == 0b111);
+        expect(reader.read_byte() == 0b00011111);
+        reader.read_bits(4);
+        expect(reader.read_byte() == 0b01010110);
+        report_passed();
+    }
+
+    void test_reading_unaligned_lsb_first_little_endian_words()
+    {
+        register_new("reading_unaligned_lsb_first_little_endian_words");
+        FilestreamReader reader(s_path_8b_dat, BitOrder::LsbFirst, ByteOrder::LittleEndian);
+        reader.read_bits(7);
+        expect(reader.read_word() == 0b0101011000100001);
+        report_passed();
+    }
+
+    void test_reading_unaligned_lsb_first_little_endian_dwords()
+    {
+        register_new("reading_unaligned_lsb_first_little_endian_dwords");
+        FilestreamReader reader(s_path_8b_dat, BitOrder::LsbFirst, ByteOrder::LittleEndian);
+        reader.read_bits(7);
+        u32 constant = 0b11000110011000010101011000100001;
+        expect(reader.read_dword() == constant);
+        report_passed();
+    }
+
+    void test_reading_unaligned_lsb_first_little_endian_qwords()
+    {
+        register_new("reading_unaligned_lsb_first_little_endian_qwords");
+        FilestreamReader reader(s_path_9b_dat, BitOrder::LsbFirst, ByteOrder::LittleEndian);
+        reader.read_bits(7);
+        u64 constant = 0b1110111010001011101011101011000011000110011000010101011000100001;
+        expect(reader.read_qword() == constant);
+        report_passed();
+    }
+
+    void test_reading_unaligned_lsb_first_big_endian_words()
+    {
+        register_new("reading_unaligned_lsb_first_big_endian_words");
+        FilestreamReader reader(s_path_8b_dat, BitOrder::LsbFirst, ByteOrder::BigEndian);
+        reader.read_bits(7);
+        expect(reader.read_word() == 0b1000100000101011);
+        report_passed();
+    }
+
+    void test_lsb_first_defaults_to_little_endian()
+    {
+        register_new("lsb_first_defaults_to_little_endian");
+        FilestreamReader reader(s_path_8b_dat, BitOrder::LsbFirst);
+        reader.read_bits(7);
+        expect(reader.peak_bits(16) == 0b0101011000100001);
+        expect(reader.read_bits(16) == 0b0101011000100001);
+        report_passed();
+    }
+
+    void test_msb_first_bits_stay_big_endian()
+    {
+        register_new("msb_first_bits_stay_big_endian");
+        FilestreamReader reader(s_path_8b_dat, ByteOrder::LittleEndian);
+        reader.read_bits(7);
+        expect(reader.peak_bits(16) == 0b1000100001010101);
+        expect(reader.read_bits(16) == 0b1000100001010101);
+        report_passed();
+    }
+
+    void test_lsb_first_peaking_beyond_the_edge_of_buffer()
+    {
+        register_new("lsb_first_peaking_beyond_the_edge_of_buffer");
+        FilestreamReader reader(s_path_8b_dat, BitOrder::LsbFirst, ByteOrder::LittleEndian, 1);
+        reader.read_bits(7);
+        expect(reader.peak_word() == 0b0101011000100001);
+        expect(reader.read_word() == 0b0101011000100001);
+        report_passed();
+    }
+
+    void test_lsb_first_forward_byte_alignment()
+    {
+        register_new("lsb_first_forward_byte_alignment");
+        FilestreamReader reader(s_path_8b_dat, BitOrder::LsbFirst);
+        reader.read_bits(3);
+        reader.byte_align_forward();
+        expect(reader.read_byte() == 0x10);
+        reader.read_dword();
+        reader.read_bits(6);
+        reader.byte_align_forward();
+        expect(reader.read_byte() == 0x45);
+        report_passed();
+    }
+
+    void test_cached_readers_share_blocks()
+    {
+        static constexpr u8 bytes[] = { 0xff, 0x10, 0xab, 0x30, 0x63, 0x58, 0xd7, 0x45 };
+        register_new("cached_readers_share_blocks");
+        BlockCache cache(1024, 2, 1);
+        for (int i = 0; i < 2; i++) {
+            FilestreamReader reader(s_path_8b_dat, cache);
+            for (auto byte : bytes)
+                expect(byte == reader.read_byte());
+        }
+        // The first reader misses on each of the 4 blocks, the second one is served
+        // from the cache.
+        auto stats = cache.stats();
+        expect(stats.misses == 4);
+        expect(stats.hits == 4);
+        expect(cache.cached_blocks_count() == 4);
+        report_passed();
+    }
+
+    void test_cache_evicts_within_memory_budget()
+    {
+        register_new("cache_evicts_within_memory_budget");
+        BlockCache cache(4, 2, 1);
+        FilestreamReader reader(s_path_8b_dat, cache);
+        reader.read_qword();
+        expect(cache.cached_blocks_count() == 2);
+        expect(cache.stats().evictions == 2);
+
+        // The block pinned by the reader survives a budget cut.
+        cache.set_memory_budget(0);
+        expect(cache.cached_blocks_count() == 1);
+        report_passed();
+    }
+
+    void test_cached_peaking_beyond_the_edge_of_buffer()
+    {
+        register_new("cached_peaking_beyond_the_edge_of_buffer");
+        BlockCache cache(1024, 1, 1);
+        FilestreamReader reader(s_path_8b_dat, cache);
+        reader.read_bits(7);
+        expect(reader.peak_word() == 0b1000100001010101);
+        expect(reader.read_word() == 0b1000100001010101);
+        // Peeking returns to the pinned block instead of looking it up again.
+        expect(cache.stats().misses == 3);
+        expect(cache.stats().hits == 2);
+        report_passed();
+    }
+
+    void test_cached_peaking_within_a_block()
+    {
+        register_new("cached_peaking_within_a_block");
+        BlockCache cache(1024, 8, 1);
+        FilestreamReader reader(s_path_8b_dat, cache);
+        for (int i = 0; i < 100; i++)
+            expect(reader.peak_bits(3) == 0b111);
+        expect(cache.stats().misses == 1);
+        expect(cache.stats().hits == 0);
+        report_passed();
+    }
+
+    void test_cache_sees_a_file_that_grows()
+    {
+        static constexpr const char* path = "../test-files/grown.tmp";
+        register_new("cache_sees_a_file_that_grows");
+        struct RemoveOnExit {
+            ~RemoveOnExit() { remove(path); }
+        } cleanup;
+
+        u8 bytes[40];
+        for (unsigned i = 0; i < sizeof(bytes); i++)
+            bytes[i] = (u8)(i * 7 + 1);
+
+        FILE* file = fopen(path, "w");
+        expect(file != nullptr);
+        fwrite(bytes, 1, 10, file);
+        fclose(file);
+
+        BlockCache cache(1024, 16, 1);
+        {
+            FilestreamReader reader(path, cache);
+            for (unsigned i = 0; i < 10; i++)
+                expect(reader.read_byte() == bytes[i]);
+            reader.read_byte();
+            expect(reader.handle_error() == true);
+        }
+        // Only the short tail block is cached, not an empty one past the end.
+        expect(cache.cached_blocks_count() == 1);
+
+        file = fopen(path, "a");
+        expect(file != nullptr);
+        fwrite(bytes + 10, 1, 30, file);
+        fclose(file);
+
+        FilestreamReader reader(path, cache);
+        for (auto byte : bytes)
+            expect(reader.read_byte() == byte);
+        expect(reader.handle_error() == false);
+        report_passed();
+    }
+
+    void test_cache_with_zero_block_size()
+    {
+        register_new("cache_with_zero_block_size");
+        BlockCache cache(1024, 0);
+        expect(cache.block_size() == 1);
+        FilestreamReader reader(s_path_8b_dat, cache);
+        expect(reader.read_word() == 0xff10);
+        report_passed();
+    }
+
+    void test_checksum_across_buffer_reloads()
+    {
+        register_new("checksum_across_buffer_reloads");
+        FilestreamReader reader(s_path_8b_dat, 3);
+        reader.begin_checksum(ChecksumKind::Crc32);
+        reader.read_qword();
+        expect(reader.end_checksum() == 0x75beddc8);
+        report_passed();
+    }
+
+    void test_checksum_of_a_region()
+    {
+        register_new("checksum_of_a_region");
+        FilestreamReader reader(s_path_8b_dat, 2);
+        reader.read_byte();
+        reader.begin_checksum(ChecksumKind::Crc32c);
+        reader.read_dword();
+        reader.read_word();
+        expect(reader.end_checksum() == 0xc7e9f8af);
+        expect(reader.read_byte() == 0x45);
+        report_passed();
+    }
+
+    void test_checksum_is_unaffected_by_peaking()
+    {
+        register_new("checksum_is_unaffected_by_peaking");
+        FilestreamReader reader(s_path_8b_dat, 1);
+        reader.begin_checksum();
+        reader.read_bits(7);
+        reader.peak_dword();
+        reader.read_bits(17);
+        expect(reader.end_checksum() == 0xf56667ce);
+        report_passed();
+    }
+
+    void test_checksum_known_values()
+    {
+        register_new("checksum_known_values");
+        auto checksum_of = [](ChecksumKind kind, const u8* data, size_t size) {
+            Checksum checksum(kind);
+            checksum.update(data, size);
+            return checksum.value();
+        };
+
+        auto digits = (const u8*)"123456789";
+        expect(checksum_of(ChecksumKind::Crc32, digits, 9) == 0xcbf43926);
+        expect(checksum_of(ChecksumKind::Crc32c, digits, 9) == 0xe3069283);
+        expect(checksum_of(ChecksumKind::Xxh32, digits, 9) == 0x937bad67);
+        expect(checksum_of(ChecksumKind::Xxh64, digits, 9) == 0x8cb841db40e6ae83);
+
+        // Long enough for the folding paths, and not a multiple of 16.
+        u8 generated[1000];
+        for (unsigned i = 0; i < sizeof(generated); i++)
+            generated[i] = (u8)(i * 31 + 7);
+        expect(checksum_of(ChecksumKind::Crc32, generated, sizeof(generated)) == 0x8902161e);
+        expect(checksum_of(ChecksumKind::Crc32c, generated, sizeof(generated)) == 0xff52ee97);
+        expect(checksum_of(ChecksumKind::Xxh32, generated, sizeof(generated)) == 0xa793e7c7);
+        expect(checksum_of(ChecksumKind::Xxh64, generated, sizeof(generated)) == 0x99594f4828043d35);
+
+        // Feeding the same bytes in uneven pieces gives the same result.
+        static constexpr ChecksumKind xxhash_kinds[] = { ChecksumKind::Xxh32, ChecksumKind::Xxh64 };
+        static constexpr u64 xxhash_expected[] = { 0xa793e7c7, 0x99594f4828043d35 };
+        for (unsigned i = 0; i < 2; i++) {
+            Checksum pieces(xxhash_kinds[i]);
+            for (size_t offset = 0, size = 1; offset < sizeof(generated); offset += size, size = size * 2 + 3) {
+                if (offset + size > sizeof(generated))
+                    size = sizeof(generated) - offset;
+                pieces.update(generated + offset, size);
+            }
+            expect(pieces.value() == xxhash_expected[i]);
+        }
+        report_passed();
+    }
+
+    void test_checksum_of_a_long_region()
+    {
+        register_new("checksum_of_a_long_region");
+        static constexpr ChecksumKind kinds[] = { ChecksumKind::Crc32, ChecksumKind::Crc32c, ChecksumKind::Xxh32, ChecksumKind::Xxh64 };
+        static constexpr u64 expected[] = { 0x920fc14c, 0x554a236a, 0x62f2bf2b, 0x042a7e8c215185b9 };
+        for (unsigned i = 0; i < 4; i++) {
+            FilestreamReader reader(s_path_200b_dat);
+            reader.read_bits(40);
+            reader.begin_checksum(kinds[i]);
+            for (unsigned j = 0; j < 171; j++)
+                reader.read_byte();
+            expect(reader.end_checksum() == expected[i]);
+        }
+        report_passed();
+    }
+
     void test_aligned_reads()
     {
         test_reading_aligned_bytes();
@@ -362,11 +668,47 @@ public:
         test_peaking_beyond_the_end_of_file();
     }
 
+    void test_lsb_first_reads()
+    {
+        test_reading_aligned_lsb_first_bytes();
+        test_reading_unaligned_lsb_first_little_endian_bytes();
+        test_reading_unaligned_lsb_first_little_endian_words();
+        test_reading_unaligned_lsb_first_little_endian_dwords();
+        test_reading_unaligned_lsb_first_little_endian_qwords();
+        test_reading_unaligned_lsb_first_big_endian_words();
+        test_lsb_first_defaults_to_little_endian();
+        test_msb_first_bits_stay_big_endian();
+        test_lsb_first_peaking_beyond_the_edge_of_buffer();
+        test_lsb_first_forward_byte_alignment();
+    }
+
+    void test_block_cache()
+    {
+        test_cached_readers_share_blocks();
+        test_cache_evicts_within_memory_budget();
+        test_cached_peaking_beyond_the_edge_of_buffer();
+        test_cached_peaking_within_a_block();
+        test_cache_sees_a_file_that_grows();
+        test_cache_with_zero_block_size();
+    }
+
+    void test_checksums()
+    {
+        test_checksum_across_buffer_reloads();
+        test_checksum_of_a_region();
+        test_checksum_is_unaffected_by_peaking();
+        test_checksum_known_values();
+        test_checksum_of_a_long_region();
+    }
+
     void run_all()
     {
         test_aligned_reads();
         test_unaligned_reads();
         test_peaking();
+        test_lsb_first_reads();
+        test_block_cache();
+        test_checksums();
         test_error_flag_is_set_when_reading_past_the_file();
         test_end_of_buffer_flag_is_set_when_buffer_is_exhausted();
         test_end_of_byte_flag_is_set_when_byte_is_fully_consumed();
@@ -0,0 +1,23 @@
+#pragma once
+#include <cinttypes>
+
+namespace Reader {
+
+using u8 = uint8_t;
+using u16 = uint16_t;
+using u32 = uint32_t;
+using u64 = uint64_t;
+
+// Identifies one version of a file for the block cache. Size and modification time
+// are part of it, so a file that changes on disk stops matching its cached blocks.
+struct FileId {
+    u64 device;
+    u64 inode;
+    u64 size;
+    u64 modified_seconds;
+    u64 modified_nanoseconds;
+
+    bool operator==(const FileId&) const = default;
+};
+
+}